@@ -9,4 +9,6 @@ if not exist bin mkdir bin
 
 pushd src
 cl /O2 /W3 all.c /Fo:..\bin\ /link /out:..\bin\iolambda.exe
+cl /O2 /W3 /c lib.c /Fo:..\bin\ && lib /nologo ..\bin\lib.obj /out:..\bin\iolambda_static.lib
+cl /O2 /W3 /LD lib.c /Fo:..\bin\ /link /DEF:iolambda.def /out:..\bin\iolambda.dll
 popd
@@ -1,6 +1,2 @@
 #include "main.c"
-#include "expr.c"
-#include "parser.c"
-#include "print_expr.c"
-#include "beta_eval.c"
-#include "expr_buf.c"
+#include "lib.c"
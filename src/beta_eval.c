@@ -1,7 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "print_expr.h"
 #include "expr_buf.h"
 #include "beta_eval.h"
+#include "snapshot.h"
 
 static struct expr expr_bool_false() {
 	return mk_multi_lam_expr(mk_bvar_expr(0), 2);
@@ -11,37 +14,172 @@ static struct expr expr_bool_true() {
 	return mk_multi_lam_expr(mk_bvar_expr(1), 2);
 }
 
+enum eval_op_result eval_op_halt(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user) {
+	return EVAL_OP_HALT;
+}
+
+enum eval_op_result eval_op_read(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user) {
+	if (state->byte_read_mask == 0) {
+		if (state->in_len == 0 && !state->in_eof) {
+			return EVAL_OP_NEED_INPUT;
+		}
+		state->byte_read = 0;
+		if (state->in_len > 0) {
+			state->byte_read = *state->in++;
+			state->in_len--;
+		}
+		state->byte_read_mask = 0x80;
+	}
+	if (state->byte_read & state->byte_read_mask) {
+		expr_buf_push(new_args, expr_bool_true());
+	} else {
+		expr_buf_push(new_args, expr_bool_false());
+	}
+	state->byte_read_mask >>= 1;
+	return EVAL_OP_CONTINUE;
+}
+
+static enum eval_op_result eval_write_bit(struct eval_state * state, int bit) {
+	if (state->byte_write_mask == 1 && state->out_len >= state->out_cap) {
+		return EVAL_OP_OUTPUT_READY;
+	}
+	if (bit) {
+		state->byte_write |= state->byte_write_mask;
+	}
+	state->byte_write_mask >>= 1;
+	if (state->byte_write_mask == 0) {
+		state->out[state->out_len++] = state->byte_write;
+		state->byte_write = 0;
+		state->byte_write_mask = 0x80;
+	}
+	return EVAL_OP_CONTINUE;
+}
+
+enum eval_op_result eval_op_bit0(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user) {
+	return eval_write_bit(state, 0);
+}
+
+enum eval_op_result eval_op_bit1(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user) {
+	return eval_write_bit(state, 1);
+}
+
+void eval_set_op(struct eval_state * state, unsigned int op, eval_op_handler handler, void * user) {
+	if (op >= state->op_count) {
+		state->ops = realloc(state->ops, sizeof(struct eval_op) * (op + 1));
+		for (unsigned int i = state->op_count; i <= op; i++) {
+			state->ops[i] = (struct eval_op) { .handler = NULL, .user = NULL };
+		}
+		state->op_count = op + 1;
+	}
+	state->ops[op] = (struct eval_op) { .handler = handler, .user = user };
+}
+
+void eval_compact(struct eval_state * state) {
+	if (state->halted) {
+		return;
+	}
+	expr_heap_compact_begin(&state->heap);
+	expr_heap_compact_root(&state->heap, &state->e);
+	// the next argument to be used is on top
+	for (size_t i = state->args.size; i > state->args.off;) {
+		i--;
+		expr_heap_compact_root(&state->heap, &state->args.data[i]);
+	}
+	expr_heap_compact_end(&state->heap);
+}
+
 // owned e
-void eval_by_reduce(struct expr e, int trace) {
-	struct expr_buf args = expr_buf_new();
-	int op_stream = 0;
-	unsigned char byte_read = 0;
-	unsigned char byte_read_mask = 0;
-	unsigned char byte_write = 0;
-	unsigned char byte_write_mask = 0x80;
+void eval_init(struct eval_state * state, struct expr_heap * heap, struct expr e, int trace) {
+	state->heap = *heap;
+	expr_heap_init(heap);
+	state->e = e;
+	state->args = expr_buf_new();
+	state->op_stream = 0;
+	state->trace = trace;
+	state->auto_compact = 0;
+	state->halted = 0;
+	state->byte_read = 0;
+	state->byte_read_mask = 0;
+	state->byte_write = 0;
+	state->byte_write_mask = 0x80;
+	state->ops = NULL;
+	state->op_count = 0;
+	eval_set_op(state, 0, eval_op_halt, NULL);
+	eval_set_op(state, 1, eval_op_read, NULL);
+	eval_set_op(state, 2, eval_op_bit0, NULL);
+	eval_set_op(state, 3, eval_op_bit1, NULL);
+	state->profile = NULL;
+	state->site = 0;
+	state->in = NULL;
+	state->in_len = 0;
+	state->in_eof = 0;
+	state->out = NULL;
+	state->out_cap = 0;
+	state->out_len = 0;
+}
+
+void eval_free(struct eval_state * state) {
+	// all nodes of the state are in its heap
+	expr_heap_free(&state->heap);
+	state->e = mk_op_expr(0);
+	free(state->args.data);
+	free(state->ops);
+	state->args = expr_buf_new();
+	state->ops = NULL;
+	state->op_count = 0;
+	state->halted = 1;
+}
+
+enum eval_status eval_step(struct eval_state * state, size_t max_reductions) {
+	if (state->halted) {
+		return EVAL_HALTED;
+	}
+	enum eval_status status;
+	size_t reductions = 0;
+	struct expr e = state->e;
+	struct expr_buf args = state->args;
 start:
 	if (e.lam_count > 0) {
+		if (reductions >= max_reductions) {
+			status = EVAL_BUDGET_EXHAUSTED;
+			goto suspend;
+		}
+		reductions++;
+		if (state->auto_compact && expr_heap_should_compact(&state->heap)) {
+			state->e = e;
+			state->args = args;
+			eval_compact(state);
+			e = state->e;
+		}
 		// beta-reduce
-		struct expr body = { .node = e.node, .lam_count = 0 };
+		struct expr body = { .node = e.node, .lam_count = 0, .loc = 0 };
 		size_t lam_count = e.lam_count;
 		if (args.size - args.off < lam_count) {
 			size_t diff = lam_count - args.size;
 			expr_buf_extend_front(&args, diff);
-			if (op_stream < 0) {
+			if (state->op_stream < 0) {
 				for (size_t i = 0; i < diff; i++) {
 					args.data[args.off + i] = mk_op_expr(0);
 				}
 			} else {
 				for (size_t i = 0; i < diff; i++) {
-					args.data[args.off + i] = mk_op_expr((int) (op_stream + diff - i - 1));
+					args.data[args.off + i] = mk_op_expr((int) (state->op_stream + diff - i - 1));
 				}
-				op_stream = (int) (op_stream + diff);
+				state->op_stream = (int) (state->op_stream + diff);
 			}
 		}
 		args.size -= lam_count;
-		e = expr_instantiate_rev(body, args.data + args.size, (unsigned int) lam_count);
+		if (state->profile != NULL) {
+			unsigned int lam = e.loc;
+			size_t allocs = state->heap.allocs;
+			e = expr_instantiate_rev(&state->heap, body, args.data + args.size, (unsigned int) lam_count);
+			profile_count(state->profile, PROFILE_BETA, state->site, lam, 1);
+			profile_count(state->profile, PROFILE_ALLOC, state->site, lam, state->heap.allocs - allocs);
+		} else {
+			e = expr_instantiate_rev(&state->heap, body, args.data + args.size, (unsigned int) lam_count);
+		}
 		for (size_t i = 0; i < lam_count; i++) {
-			expr_dec_rc(args.data[args.size + i]);
+			expr_dec_rc(&state->heap, args.data[args.size + i]);
 		}
 		goto start;
 	}
@@ -50,18 +188,43 @@ start:
 		struct expr arg = e.node->arg;
 		expr_inc_rc(fn);
 		expr_inc_rc(arg);
-		expr_dec_rc(e);
+		if (state->profile != NULL) {
+			state->site = e.node->loc;
+		}
+		expr_dec_rc(&state->heap, e);
 		expr_buf_push(&args, arg);
 		e = fn;
 		goto start;
 	}
 	if (expr_node_is_op(e.node)) {
+		if (reductions >= max_reductions) {
+			status = EVAL_BUDGET_EXHAUSTED;
+			goto suspend;
+		}
+		reductions++;
 		int op = expr_node_get_op(e.node);
 		for (size_t i = args.off; i + 1 < args.size; i++) {
-			expr_dec_rc(args.data[i]);
+			expr_dec_rc(&state->heap, args.data[i]);
 		}
 		e = args.size > args.off ? args.data[args.size - 1] : mk_op_expr(0);
-		if (trace) {
+		args.size = 0;
+		args.off = 0;
+		enum eval_op_result result = EVAL_OP_HALT;
+		if ((unsigned int) op < state->op_count && state->ops[op].handler != NULL) {
+			result = state->ops[op].handler(state, op, e, &args, state->ops[op].user);
+		}
+		if (result == EVAL_OP_NEED_INPUT) {
+			status = EVAL_NEED_INPUT;
+			goto block;
+		}
+		if (result == EVAL_OP_OUTPUT_READY) {
+			status = EVAL_OUTPUT_READY;
+			goto block;
+		}
+		if (state->profile != NULL) {
+			profile_count(state->profile, PROFILE_OP, state->site, op, 1);
+		}
+		if (state->trace) {
 			// debug print
 			char * str = dbg_expr_to_str(e);
 			printf("operation %d with %s\n", op, str);
@@ -73,49 +236,123 @@ start:
 				free(str);
 			}*/
 		}
-		args.size = 0;
-		args.off = 0;
-		switch (op) {
-		case 1: {
-			if (byte_read_mask == 0) {
-				byte_read = 0;
-				fread(&byte_read, 1, 1, stdin);
-				byte_read_mask = 0x80;
+		if (result != EVAL_OP_CONTINUE) {
+			goto end;
+		}
+		state->op_stream = -1;
+		if (state->trace && state->out_len > 0) {
+			// hand out every byte right after its operation so it stays in order with the trace
+			status = EVAL_OUTPUT_READY;
+			goto suspend;
+		}
+		goto start;
+block:
+		// the other arguments are ignored by operations anyway,
+		// so retrying with just the continuation is equivalent
+		expr_buf_push(&args, e);
+		e = mk_op_expr(op);
+		goto suspend;
+	}
+end:
+	expr_dec_rc(&state->heap, e);
+	for (size_t i = args.off; i < args.size; i++) {
+		expr_dec_rc(&state->heap, args.data[i]);
+	}
+	args.size = 0;
+	args.off = 0;
+	state->e = mk_op_expr(0);
+	state->args = args;
+	state->halted = 1;
+	return EVAL_HALTED;
+suspend:
+	state->e = e;
+	state->args = args;
+	return status;
+}
+
+// reductions between rewrites of the profile, so programs that don't halt still leave one behind
+#define EVAL_PROFILE_SAVE_INTERVAL (1 << 24)
+
+static void eval_save_profile(struct eval_state * state) {
+	if (state->profile != NULL && state->profile->out_file != NULL && profile_save(state->profile) != 0) {
+		fprintf(stderr, "Failed to write profile %s\n", state->profile->out_file);
+	}
+}
+
+static int eval_write_snapshot_file(void * user, const void * data, size_t len) {
+	return fwrite(data, 1, len, (FILE *) user) == len ? 0 : 1;
+}
+
+static void eval_save_snapshot(struct eval_state * state, const unsigned char * output, size_t output_len, const char * snapshot_file) {
+	FILE * f = fopen(snapshot_file, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", snapshot_file);
+		return;
+	}
+	int failed = eval_snapshot_write(state, output, output_len, eval_write_snapshot_file, f) != 0;
+	failed = fclose(f) != 0 || failed;
+	if (failed) {
+		// don't leave a truncated snapshot behind
+		remove(snapshot_file);
+		fprintf(stderr, "Failed to write snapshot %s\n", snapshot_file);
+	}
+}
+
+void eval_run_stdio(struct eval_state * state, const unsigned char * output, size_t output_len, const char * snapshot_file) {
+	unsigned char in_byte;
+	unsigned char out_buf[4096];
+	// output so far, kept until the snapshot is taken
+	unsigned char * written = NULL;
+	size_t written_len = 0;
+	if (snapshot_file != NULL && output_len > 0) {
+		written = malloc(output_len);
+		memcpy(written, output, output_len);
+		written_len = output_len;
+	}
+	state->out = out_buf;
+	state->out_len = 0;
+	state->out_cap = sizeof(out_buf);
+	size_t budget = state->profile != NULL && state->profile->out_file != NULL ? EVAL_PROFILE_SAVE_INTERVAL : (size_t) -1;
+	while (1) {
+		enum eval_status status = eval_step(state, budget);
+		if (state->out_len > 0) {
+			if (fwrite(state->out, 1, state->out_len, stdout) != state->out_len) {
+				// nobody is listening anymore (e.g. a closed pipe with SIGPIPE ignored)
+				break;
 			}
-			if (byte_read & byte_read_mask) {
-				expr_buf_push(&args, expr_bool_true());
-			} else {
-				expr_buf_push(&args, expr_bool_false());
+			if (snapshot_file != NULL) {
+				written = realloc(written, written_len + state->out_len);
+				memcpy(written + written_len, state->out, state->out_len);
+				written_len += state->out_len;
 			}
-			byte_read_mask >>= 1;
-		} break;
-		case 2: {
-			byte_write_mask >>= 1;
-			if (byte_write_mask == 0) {
-				fwrite(&byte_write, 1, 1, stdout);
-				byte_write = 0;
-				byte_write_mask = 0x80;
+			state->out_len = 0;
+		}
+		if (status == EVAL_HALTED) {
+			break;
+		}
+		if (status == EVAL_BUDGET_EXHAUSTED) {
+			eval_save_profile(state);
+		}
+		if (status == EVAL_NEED_INPUT) {
+			if (snapshot_file != NULL) {
+				eval_save_snapshot(state, written, written_len, snapshot_file);
+				free(written);
+				written = NULL;
+				snapshot_file = NULL;
 			}
-		} break;
-		case 3: {
-			byte_write |= byte_write_mask;
-			byte_write_mask >>= 1;
-			if (byte_write_mask == 0) {
-				fwrite(&byte_write, 1, 1, stdout);
-				byte_write = 0;
-				byte_write_mask = 0x80;
+			state->in = &in_byte;
+			state->in_len = fread(&in_byte, 1, 1, stdin);
+			if (state->in_len == 0) {
+				state->in_eof = 1;
+				eval_save_profile(state);
 			}
-		} break;
-		default: goto end;
 		}
-		op_stream = -1;
-		goto start;
 	}
-end:
-	expr_dec_rc(e);
-	for (size_t i = args.off; i < args.size; i++) {
-		expr_dec_rc(args.data[i]);
+	eval_save_profile(state);
+	if (snapshot_file != NULL) {
+		fprintf(stderr, "Program halted before reading input, no snapshot written\n");
 	}
-	free(args.data);
-	return;
+	free(written);
+	state->out = NULL;
+	state->out_cap = 0;
 }
@@ -1,8 +1,95 @@
 #ifndef BETA_EVAL_H
 #define BETA_EVAL_H
 
+#include <stdio.h>
 #include "expr.h"
+#include "expr_buf.h"
+#include "profile.h"
 
-void eval_by_reduce(struct expr e, int trace);
+enum eval_status {
+	EVAL_NEED_INPUT, // `in` is exhausted and the program wants to read
+	EVAL_OUTPUT_READY, // `out` is full and the program wants to write (when tracing: after every written byte)
+	EVAL_HALTED,
+	EVAL_BUDGET_EXHAUSTED,
+};
+
+enum eval_op_result {
+	EVAL_OP_CONTINUE,
+	EVAL_OP_HALT,
+	// blocking results: nothing may have been pushed, the operation is retried on the next `eval_step`
+	EVAL_OP_NEED_INPUT,
+	EVAL_OP_OUTPUT_READY,
+};
+
+struct eval_state;
+
+// borrowed cont, the new arguments get pushed onto `new_args` (which starts out empty),
+// the last one pushed is the first argument given to the continuation
+typedef enum eval_op_result (*eval_op_handler)(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user);
+
+struct eval_op {
+	eval_op_handler handler;
+	void * user;
+};
+
+struct eval_state {
+	struct expr_heap heap; // owned, holds all nodes of the state, handlers allocate from it too
+	struct expr e; // owned
+	struct expr_buf args;
+	int op_stream;
+	int trace;
+	// run `eval_compact` from `eval_step` when `expr_heap_should_compact` says so,
+	// only safe if every live node of the heap is reachable from the state
+	int auto_compact;
+	int halted;
+	unsigned char byte_read;
+	unsigned char byte_read_mask;
+	unsigned char byte_write;
+	unsigned char byte_write_mask;
+
+	// operations without a handler behave like `halt`
+	struct eval_op * ops; // owned
+	unsigned int op_count;
+
+	struct profile * profile; // borrowed, NULL unless profiling
+	unsigned int site; // location of the last unwound application, for the profile
+
+	// input bytes, borrowed, consumed from the front
+	const unsigned char * in;
+	size_t in_len;
+	int in_eof; // no more input will come, further reads see zero bits
+
+	// output bytes, borrowed, the caller drains by resetting `out_len`
+	unsigned char * out;
+	size_t out_cap;
+	size_t out_len;
+};
+
+// The built-in operations, registered as 0 to 3 by `eval_init`
+enum eval_op_result eval_op_halt(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user);
+enum eval_op_result eval_op_read(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user);
+enum eval_op_result eval_op_bit0(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user);
+enum eval_op_result eval_op_bit1(struct eval_state * state, unsigned int op, struct expr cont, struct expr_buf * new_args, void * user);
+
+// owned e, takes over the nodes of heap (which e has to be from), leaving it empty
+void eval_init(struct eval_state * state, struct expr_heap * heap, struct expr e, int trace);
+// releases all nodes in the heap of the state
+void eval_free(struct eval_state * state);
+
+// handler may be NULL to make the operation halt
+void eval_set_op(struct eval_state * state, unsigned int op, eval_op_handler handler, void * user);
+
+// Compacts the heap of the state with its term and arguments as roots
+void eval_compact(struct eval_state * state);
+
+// Runs until the program halts, blocks on I/O or did `max_reductions` beta reductions and operations.
+// Can be called again after any status to resume (halted programs stay halted).
+enum eval_status eval_step(struct eval_state * state, size_t max_reductions);
+
+// Runs state until it halts or writing to stdout fails, with stdin and stdout for I/O.
+// If snapshot_file isn't NULL, the file is created and the state saved to it the first time the program waits for input,
+// along with `output` (what the program wrote before this run, e.g. when it was restored) and the output of this run.
+// If the state has a profile with an `out_file`, it's saved periodically, at the end of the input and on halt.
+void eval_run_stdio(struct eval_state * state, const unsigned char * output, size_t output_len, const char * snapshot_file);
 
 #endif
@@ -0,0 +1,326 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emit_c.h"
+
+struct emit_buf {
+	char * data; // owned
+	size_t size;
+	size_t capacity;
+};
+
+static void emit_printf(struct emit_buf * buf, const char * fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (buf->size + len + 1 > buf->capacity) {
+		size_t new_capacity = buf->capacity < 256 ? 256 : buf->capacity;
+		while (buf->size + len + 1 > new_capacity) {
+			new_capacity *= 2;
+		}
+		buf->data = realloc(buf->data, new_capacity);
+		buf->capacity = new_capacity;
+	}
+	va_start(args, fmt);
+	vsnprintf(buf->data + buf->size, len + 1, fmt, args);
+	va_end(args);
+	buf->size += len;
+}
+
+struct emit_ctx {
+	struct emit_buf * bodies; // owned, indexed by supercombinator
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int max_arity;
+};
+
+// the variables of a supercombinator body: parameters `a[0..arity)` followed by the captures
+struct emit_scope {
+	unsigned int arity;
+	unsigned int * captures; // sorted, indices relative to the outside of the lambda group
+	unsigned int capture_count;
+};
+
+static void collect_captures(struct expr e, unsigned int depth, unsigned char * used) {
+	depth += e.lam_count;
+	if (expr_node_is_bvar(e.node)) {
+		unsigned int var = expr_node_get_bvar(e.node);
+		if (var >= depth) {
+			used[var - depth] = 1;
+		}
+	} else if (expr_node_is_app(e.node)) {
+		if (e.node->bvar_range <= depth) {
+			return;
+		}
+		collect_captures(e.node->fn, depth, used);
+		collect_captures(e.node->arg, depth, used);
+	}
+}
+
+static void emit_var(struct emit_buf * out, struct emit_scope * scope, unsigned int var) {
+	if (var < scope->arity) {
+		emit_printf(out, "a[%u]", var);
+		return;
+	}
+	unsigned int i = 0;
+	while (scope->captures[i] != var - scope->arity) {
+		i++;
+	}
+	emit_printf(out, "self->env[%u]", i);
+}
+
+static unsigned int emit_code(struct emit_ctx * ctx, struct expr e, struct emit_scope * scope);
+
+// writes statements that set `target` to a new closure of e, which is in the body of `scope`
+static void emit_closure(struct emit_ctx * ctx, struct emit_buf * out, const char * target, struct expr e, struct emit_scope * scope) {
+	struct emit_scope inner;
+	unsigned int id = emit_code(ctx, e, &inner);
+	emit_printf(out, "%s = mk_clo(sc_%u, %u, %u);", target, id, inner.arity, inner.capture_count);
+	for (unsigned int i = 0; i < inner.capture_count; i++) {
+		emit_printf(out, " %s->env[%u] = retain(", target, i);
+		emit_var(out, scope, inner.captures[i]);
+		emit_printf(out, ");");
+	}
+	free(inner.captures);
+}
+
+// writes an expression for the value of e, which is in the body of `scope`
+static void emit_value(struct emit_ctx * ctx, struct emit_buf * out, const char * target, struct expr e, struct emit_scope * scope) {
+	if (e.lam_count == 0 && expr_node_is_bvar(e.node)) {
+		emit_printf(out, "%s = retain(", target);
+		emit_var(out, scope, expr_node_get_bvar(e.node));
+		emit_printf(out, ");");
+	} else if (e.lam_count == 0 && expr_node_is_op(e.node)) {
+		emit_printf(out, "%s = MK_OP(%u);", target, expr_node_get_op(e.node));
+	} else {
+		emit_closure(ctx, out, target, e, scope);
+	}
+}
+
+// Lambda lifts e into a new supercombinator, fills in its scope and returns its index
+static unsigned int emit_code(struct emit_ctx * ctx, struct expr e, struct emit_scope * scope) {
+	unsigned int id = ctx->count++;
+	if (ctx->count > ctx->capacity) {
+		ctx->capacity = ctx->capacity < 16 ? 16 : ctx->capacity * 2;
+		ctx->bodies = realloc(ctx->bodies, sizeof(struct emit_buf) * ctx->capacity);
+	}
+	scope->arity = e.lam_count;
+	if (scope->arity > ctx->max_arity) {
+		ctx->max_arity = scope->arity;
+	}
+	unsigned int range = expr_get_bvar_range(e);
+	unsigned char * used = calloc(range + 1, 1);
+	collect_captures(e, 0, used);
+	scope->captures = malloc(sizeof(unsigned int) * (range + 1));
+	scope->capture_count = 0;
+	for (unsigned int i = 0; i < range; i++) {
+		if (used[i]) {
+			scope->captures[scope->capture_count++] = i;
+		}
+	}
+	free(used);
+
+	struct emit_buf body = { .data = NULL, .size = 0, .capacity = 0 };
+	struct expr head = { .node = e.node, .lam_count = 0 };
+	emit_printf(&body, "static struct val * sc_%u(struct val * self, struct val ** a) {\n", id);
+	emit_printf(&body, "\tstruct val * r;\n");
+	// push the arguments of the spine, the first one ends up on top
+	while (head.lam_count == 0 && expr_node_is_app(head.node)) {
+		emit_printf(&body, "\t{ struct val * c; ");
+		emit_value(ctx, &body, "c", head.node->arg, scope);
+		emit_printf(&body, " push(c); }\n");
+		head = head.node->fn;
+	}
+	emit_printf(&body, "\t");
+	emit_value(ctx, &body, "r", head, scope);
+	emit_printf(&body, "\n");
+	for (unsigned int i = 0; i < scope->arity; i++) {
+		emit_printf(&body, "\trelease(a[%u]);\n", i);
+	}
+	emit_printf(&body, "\trelease(self);\n");
+	emit_printf(&body, "\treturn r;\n");
+	emit_printf(&body, "}\n\n");
+	ctx->bodies[id] = body;
+	return id;
+}
+
+static const char emit_c_runtime[] =
+	"#include <stdio.h>\n"
+	"#include <stdlib.h>\n"
+	"#include <string.h>\n"
+	"\n"
+	"struct val;\n"
+	"typedef struct val * (*code_fn)(struct val * self, struct val ** a);\n"
+	"\n"
+	"// operations are represented as `(struct val *) ((n << 2) | 3)`\n"
+	"struct val {\n"
+	"\tunsigned int rc;\n"
+	"\tunsigned int arity;\n"
+	"\tcode_fn code;\n"
+	"\tunsigned int env_count;\n"
+	"\tstruct val * env[];\n"
+	"};\n"
+	"\n"
+	"#define IS_OP(v) ((((size_t) (v)) & 3) == 3)\n"
+	"#define MK_OP(n) ((struct val *) ((((size_t) (n)) << 2) | 3))\n"
+	"#define GET_OP(v) ((unsigned int) (((size_t) (v)) >> 2))\n"
+	"#define FREE_LIST_COUNT 8\n"
+	"\n"
+	"static struct val * free_lists[FREE_LIST_COUNT]; // linked through `env[0]`\n"
+	"static struct val ** stack;\n"
+	"static size_t stack_size;\n"
+	"static size_t stack_capacity;\n"
+	"\n"
+	"static struct val * mk_clo(code_fn code, unsigned int arity, unsigned int env_count) {\n"
+	"\tstruct val * v;\n"
+	"\tif (env_count < FREE_LIST_COUNT && free_lists[env_count] != NULL) {\n"
+	"\t\tv = free_lists[env_count];\n"
+	"\t\tfree_lists[env_count] = v->env[0];\n"
+	"\t} else {\n"
+	"\t\tv = malloc(sizeof(struct val) + sizeof(struct val *) * (env_count > 0 ? env_count : 1));\n"
+	"\t}\n"
+	"\tv->rc = 1;\n"
+	"\tv->arity = arity;\n"
+	"\tv->code = code;\n"
+	"\tv->env_count = env_count;\n"
+	"\treturn v;\n"
+	"}\n"
+	"\n"
+	"static inline struct val * retain(struct val * v) {\n"
+	"\tif (!IS_OP(v)) {\n"
+	"\t\tv->rc++;\n"
+	"\t}\n"
+	"\treturn v;\n"
+	"}\n"
+	"\n"
+	"static void release(struct val * v) {\n"
+	"\tif (IS_OP(v) || --v->rc != 0) {\n"
+	"\t\treturn;\n"
+	"\t}\n"
+	"\tfor (unsigned int i = 0; i < v->env_count; i++) {\n"
+	"\t\trelease(v->env[i]);\n"
+	"\t}\n"
+	"\tif (v->env_count < FREE_LIST_COUNT) {\n"
+	"\t\tv->env[0] = free_lists[v->env_count];\n"
+	"\t\tfree_lists[v->env_count] = v;\n"
+	"\t} else {\n"
+	"\t\tfree(v);\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"static inline void push(struct val * v) {\n"
+	"\tif (stack_size >= stack_capacity) {\n"
+	"\t\tstack_capacity = stack_capacity < 16 ? 16 : stack_capacity * 2;\n"
+	"\t\tstack = realloc(stack, sizeof(struct val *) * stack_capacity);\n"
+	"\t}\n"
+	"\tstack[stack_size++] = v;\n"
+	"}\n"
+	"\n"
+	"// \\x y. y\n"
+	"static struct val * sc_false(struct val * self, struct val ** a) {\n"
+	"\trelease(a[1]);\n"
+	"\trelease(self);\n"
+	"\treturn a[0];\n"
+	"}\n"
+	"\n"
+	"// \\x y. x\n"
+	"static struct val * sc_true(struct val * self, struct val ** a) {\n"
+	"\trelease(a[0]);\n"
+	"\trelease(self);\n"
+	"\treturn a[1];\n"
+	"}\n"
+	"\n"
+	"static struct val bool_false = { .rc = 1, .arity = 2, .code = sc_false, .env_count = 0 };\n"
+	"static struct val bool_true = { .rc = 1, .arity = 2, .code = sc_true, .env_count = 0 };\n"
+	"\n";
+
+static const char emit_c_main[] =
+	"int main() {\n"
+	"\tstruct val * a[MAX_ARITY];\n"
+	"\tstruct val * cur = mk_clo(sc_0, ROOT_ARITY, 0);\n"
+	"\tint op_stream = 0;\n"
+	"\tunsigned char byte_read = 0;\n"
+	"\tunsigned char byte_read_mask = 0;\n"
+	"\tunsigned char byte_write = 0;\n"
+	"\tunsigned char byte_write_mask = 0x80;\n"
+	"\twhile (1) {\n"
+	"\t\tif (!IS_OP(cur)) {\n"
+	"\t\t\tunsigned int arity = cur->arity;\n"
+	"\t\t\tif (stack_size < arity) {\n"
+	"\t\t\t\t// missing arguments are taken from the operation stream\n"
+	"\t\t\t\tsize_t diff = arity - stack_size;\n"
+	"\t\t\t\tfor (size_t i = 0; i < diff; i++) {\n"
+	"\t\t\t\t\ta[i] = op_stream < 0 ? MK_OP(0) : MK_OP(op_stream + diff - i - 1);\n"
+	"\t\t\t\t}\n"
+	"\t\t\t\tif (op_stream >= 0) {\n"
+	"\t\t\t\t\top_stream = (int) (op_stream + diff);\n"
+	"\t\t\t\t}\n"
+	"\t\t\t\tmemcpy(a + diff, stack, sizeof(struct val *) * stack_size);\n"
+	"\t\t\t\tstack_size = 0;\n"
+	"\t\t\t} else {\n"
+	"\t\t\t\tstack_size -= arity;\n"
+	"\t\t\t\tmemcpy(a, stack + stack_size, sizeof(struct val *) * arity);\n"
+	"\t\t\t}\n"
+	"\t\t\tcur = cur->code(cur, a);\n"
+	"\t\t\tcontinue;\n"
+	"\t\t}\n"
+	"\t\tunsigned int op = GET_OP(cur);\n"
+	"\t\tfor (size_t i = 0; i + 1 < stack_size; i++) {\n"
+	"\t\t\trelease(stack[i]);\n"
+	"\t\t}\n"
+	"\t\tcur = stack_size > 0 ? stack[stack_size - 1] : MK_OP(0);\n"
+	"\t\tstack_size = 0;\n"
+	"\t\tswitch (op) {\n"
+	"\t\tcase 1: {\n"
+	"\t\t\tif (byte_read_mask == 0) {\n"
+	"\t\t\t\tint ch = getchar();\n"
+	"\t\t\t\tbyte_read = ch == EOF ? 0 : (unsigned char) ch;\n"
+	"\t\t\t\tbyte_read_mask = 0x80;\n"
+	"\t\t\t}\n"
+	"\t\t\tpush(retain(byte_read & byte_read_mask ? &bool_true : &bool_false));\n"
+	"\t\t\tbyte_read_mask >>= 1;\n"
+	"\t\t} break;\n"
+	"\t\tcase 2:\n"
+	"\t\tcase 3: {\n"
+	"\t\t\tif (op == 3) {\n"
+	"\t\t\t\tbyte_write |= byte_write_mask;\n"
+	"\t\t\t}\n"
+	"\t\t\tbyte_write_mask >>= 1;\n"
+	"\t\t\tif (byte_write_mask == 0) {\n"
+	"\t\t\t\tputchar(byte_write);\n"
+	"\t\t\t\tbyte_write = 0;\n"
+	"\t\t\t\tbyte_write_mask = 0x80;\n"
+	"\t\t\t}\n"
+	"\t\t} break;\n"
+	"\t\tdefault:\n"
+	"\t\t\trelease(cur);\n"
+	"\t\t\treturn 0;\n"
+	"\t\t}\n"
+	"\t\top_stream = -1;\n"
+	"\t}\n"
+	"}\n";
+
+// borrowed e
+void emit_c(struct expr e, FILE * out) {
+	struct emit_ctx ctx = { .bodies = NULL, .count = 0, .capacity = 0, .max_arity = 2 };
+	struct emit_scope root;
+	emit_code(&ctx, e, &root);
+	free(root.captures);
+
+	fputs("// Generated by iolambda --emit-c\n\n", out);
+	fputs(emit_c_runtime, out);
+	fprintf(out, "#define MAX_ARITY %u\n", ctx.max_arity);
+	fprintf(out, "#define ROOT_ARITY %u\n\n", e.lam_count);
+	for (unsigned int i = 0; i < ctx.count; i++) {
+		fprintf(out, "static struct val * sc_%u(struct val * self, struct val ** a);\n", i);
+	}
+	fputs("\n", out);
+	for (unsigned int i = 0; i < ctx.count; i++) {
+		fwrite(ctx.bodies[i].data, 1, ctx.bodies[i].size, out);
+		free(ctx.bodies[i].data);
+	}
+	fputs(emit_c_main, out);
+	free(ctx.bodies);
+}
@@ -0,0 +1,13 @@
+#ifndef EMIT_C_H
+#define EMIT_C_H
+
+#include <stdio.h>
+#include "expr.h"
+
+// Compiles a closed program into a standalone C program with the default operation table.
+// Every lambda group and every non-variable argument becomes a supercombinator
+// that takes its captured variables from the closure and its parameters from the argument stack.
+// borrowed e
+void emit_c(struct expr e, FILE * out);
+
+#endif
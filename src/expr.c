@@ -16,21 +16,157 @@ unsigned int expr_get_bvar_range(struct expr e) {
 	return inner_range - e.lam_count;
 }
 
-struct expr_node * mk_app_expr_node() {
-	struct expr_node * node = malloc(sizeof(struct expr_node));
+#define EXPR_SLAB_MIN_COUNT 4096
+#define EXPR_COMPACT_MIN_CAPACITY (1 << 16)
+#define EXPR_COMPACT_MIN_ALLOCS (1 << 22)
+
+void expr_heap_init(struct expr_heap * heap) {
+	heap->slabs = NULL;
+	heap->free_list = NULL;
+	heap->fresh = 0;
+	heap->capacity = 0;
+	heap->live = 0;
+	heap->allocs = 0;
+	heap->allocs_at_compact = 0;
+	heap->live_at_compact = 0;
+	heap->old_slabs = NULL;
+	heap->compact_stack = NULL;
+	heap->compact_stack_size = 0;
+	heap->compact_stack_capacity = 0;
+}
+
+static void expr_heap_free_slabs(struct expr_slab * slab) {
+	while (slab != NULL) {
+		struct expr_slab * next = slab->next;
+		free(slab);
+		slab = next;
+	}
+}
+
+void expr_heap_free(struct expr_heap * heap) {
+	expr_heap_free_slabs(heap->slabs);
+	expr_heap_init(heap);
+}
+
+static struct expr_slab * expr_heap_add_slab(struct expr_heap * heap, size_t count) {
+	struct expr_slab * slab = malloc(sizeof(struct expr_slab) + sizeof(struct expr_node) * count);
+	slab->next = heap->slabs;
+	slab->count = count;
+	heap->slabs = slab;
+	heap->fresh = count;
+	heap->capacity += count;
+	return slab;
+}
+
+struct expr_node * mk_app_expr_node(struct expr_heap * heap) {
+	struct expr_node * node = heap->free_list;
+	if (node != NULL) {
+		heap->free_list = node->fn.node;
+	} else {
+		if (heap->fresh == 0) {
+			size_t count = heap->capacity / 2;
+			expr_heap_add_slab(heap, count < EXPR_SLAB_MIN_COUNT ? EXPR_SLAB_MIN_COUNT : count);
+		}
+		struct expr_slab * slab = heap->slabs;
+		node = &slab->nodes[slab->count - heap->fresh--];
+	}
+	heap->live++;
+	heap->allocs++;
 	node->rc = 1;
+	node->loc = 0;
 	return node;
 }
 
+void free_expr_node(struct expr_heap * heap, struct expr_node * node) {
+	node->fn.node = heap->free_list;
+	heap->free_list = node;
+	heap->live--;
+}
+
+int expr_heap_should_compact(struct expr_heap * heap) {
+	// mostly free slabs
+	if (heap->capacity >= EXPR_COMPACT_MIN_CAPACITY && heap->capacity / 4 > heap->live) {
+		return 1;
+	}
+	// the live nodes have been scattered over the free list
+	size_t allocs = heap->allocs - heap->allocs_at_compact;
+	return allocs >= EXPR_COMPACT_MIN_ALLOCS && allocs / 16 > heap->live_at_compact;
+}
+
+void expr_heap_compact_begin(struct expr_heap * heap) {
+	heap->old_slabs = heap->slabs;
+	heap->slabs = NULL;
+	heap->free_list = NULL;
+	heap->fresh = 0;
+	heap->capacity = 0;
+	if (heap->live > 0) {
+		expr_heap_add_slab(heap, heap->live);
+	}
+	heap->live = 0;
+	heap->compact_stack_size = 0;
+}
+
+static void expr_heap_compact_push(struct expr_heap * heap, struct expr_node ** ref) {
+	if (heap->compact_stack_size >= heap->compact_stack_capacity) {
+		heap->compact_stack_capacity = heap->compact_stack_capacity < 64 ? 64 : heap->compact_stack_capacity * 2;
+		heap->compact_stack = realloc(heap->compact_stack, sizeof(struct expr_node **) * heap->compact_stack_capacity);
+	}
+	heap->compact_stack[heap->compact_stack_size++] = ref;
+}
+
+// Moves the node `*ref` points to and updates `*ref`, moved nodes have rc 0 and the new node in `fn.node`.
+// The children are moved afterwards by the caller, the function is pushed last so it's moved first.
+static void expr_heap_compact_node(struct expr_heap * heap, struct expr_node ** ref) {
+	struct expr_node * node = *ref;
+	if (node->rc == 0) {
+		*ref = node->fn.node;
+		return;
+	}
+	struct expr_slab * slab = heap->slabs;
+	struct expr_node * new_node = &slab->nodes[slab->count - heap->fresh--];
+	heap->live++;
+	*new_node = *node;
+	node->rc = 0;
+	node->fn.node = new_node;
+	*ref = new_node;
+	if (expr_node_is_app(new_node->arg.node)) {
+		expr_heap_compact_push(heap, &new_node->arg.node);
+	}
+	if (expr_node_is_app(new_node->fn.node)) {
+		expr_heap_compact_push(heap, &new_node->fn.node);
+	}
+}
+
+void expr_heap_compact_root(struct expr_heap * heap, struct expr * e) {
+	if (!expr_node_is_app(e->node)) {
+		return;
+	}
+	// iterative, the graph can be far deeper than the C stack
+	expr_heap_compact_node(heap, &e->node);
+	while (heap->compact_stack_size > 0) {
+		expr_heap_compact_node(heap, heap->compact_stack[--heap->compact_stack_size]);
+	}
+}
+
+void expr_heap_compact_end(struct expr_heap * heap) {
+	expr_heap_free_slabs(heap->old_slabs);
+	heap->old_slabs = NULL;
+	free(heap->compact_stack);
+	heap->compact_stack = NULL;
+	heap->compact_stack_capacity = 0;
+	heap->allocs_at_compact = heap->allocs;
+	heap->live_at_compact = heap->live;
+}
+
 // owned fn, owned arg, owned return
-struct expr mk_app_expr(struct expr fn, struct expr arg) {
-	struct expr_node * node = mk_app_expr_node();
+struct expr mk_app_expr(struct expr_heap * heap, struct expr fn, struct expr arg) {
+	struct expr_node * node = mk_app_expr_node(heap);
 	node->fn = fn;
 	node->arg = arg;
 	unsigned int fn_range = expr_get_bvar_range(fn);
 	unsigned int arg_range = expr_get_bvar_range(arg);
 	node->bvar_range = fn_range < arg_range ? arg_range : fn_range;
-	return (struct expr) { .node = node, .lam_count = 0 };
+	return (struct expr) { .node = node, .lam_count = 0, .loc = 0 };
 }
 
 void expr_inc_rc(struct expr e) {
@@ -39,7 +175,7 @@ void expr_inc_rc(struct expr e) {
 	}
 }
 
-void expr_dec_rc(struct expr e) {
+void expr_dec_rc(struct expr_heap * heap, struct expr e) {
 	if (expr_node_is_app(e.node)) {
 		e.node->rc--;
 		if (e.node->rc != 0) {
@@ -47,24 +183,25 @@ void expr_dec_rc(struct expr e) {
 		}
 		struct expr fn = e.node->fn;
 		struct expr arg = e.node->arg;
-		free(e.node);
-		expr_dec_rc(fn);
-		expr_dec_rc(arg);
+		free_expr_node(heap, e.node);
+		expr_dec_rc(heap, fn);
+		expr_dec_rc(heap, arg);
 	}
 }
 
 // owned e, owned return (with rc 1)
-struct expr_node * expr_node_dup_if_shared(struct expr_node * node) {
+struct expr_node * expr_node_dup_if_shared(struct expr_heap * heap, struct expr_node * node) {
 	if (node->rc == 1) {
 		return node;
 	}
 	node->rc--;
-	struct expr_node * new_node = mk_app_expr_node();
+	struct expr_node * new_node = mk_app_expr_node(heap);
 	expr_inc_rc(node->fn);
 	expr_inc_rc(node->arg);
 	new_node->fn = node->fn;
 	new_node->arg = node->arg;
 	new_node->bvar_range = node->bvar_range;
+	new_node->loc = node->loc;
 	return new_node;
 }
 
@@ -80,7 +217,7 @@ void update_expr_data(struct expr expr) {
 }
 
 // owned e, borrowed vals, owned return
-struct expr expr_instantiate_rev_with_depth(struct expr e, unsigned int depth, struct expr * vals, unsigned int count) {
+struct expr expr_instantiate_rev_with_depth(struct expr_heap * heap, struct expr e, unsigned int depth, struct expr * vals, unsigned int count) {
 	depth += e.lam_count;
 	if (expr_node_is_bvar(e.node)) {
 		unsigned int var = expr_node_get_bvar(e.node);
@@ -90,21 +227,25 @@ struct expr expr_instantiate_rev_with_depth(struct expr e, unsigned int depth, s
 		if (var - depth < count) {
 			struct expr out = vals[var - depth];
 			expr_inc_rc(out);
-			return mk_multi_lam_expr(out, e.lam_count);
+			out = mk_multi_lam_expr(out, e.lam_count);
+			if (e.lam_count > 0) {
+				out.loc = e.loc;
+			}
+			return out;
 		}
-		return (struct expr) { .node = mk_bvar_expr_node(var - 1), .lam_count = e.lam_count };
+		return (struct expr) { .node = mk_bvar_expr_node(var - 1), .lam_count = e.lam_count, .loc = e.loc };
 	} else if (expr_node_is_app(e.node)) {
 		if (e.node->bvar_range <= depth) {
 			return e;
 		}
-		struct expr_node * new_node = expr_node_dup_if_shared(e.node);
-		new_node->fn = expr_instantiate_rev_with_depth(new_node->fn, depth, vals, count);
-		new_node->arg = expr_instantiate_rev_with_depth(new_node->arg, depth, vals, count);
+		struct expr_node * new_node = expr_node_dup_if_shared(heap, e.node);
+		new_node->fn = expr_instantiate_rev_with_depth(heap, new_node->fn, depth, vals, count);
+		new_node->arg = expr_instantiate_rev_with_depth(heap, new_node->arg, depth, vals, count);
 
 		unsigned int fn_range = expr_get_bvar_range(new_node->fn);
 		unsigned int arg_range = expr_get_bvar_range(new_node->arg);
 		new_node->bvar_range = fn_range < arg_range ? arg_range : fn_range;
-		return (struct expr) { .node = new_node, .lam_count = e.lam_count };
+		return (struct expr) { .node = new_node, .lam_count = e.lam_count, .loc = e.loc };
 	} else {
 		return e;
 	}
@@ -112,7 +253,7 @@ struct expr expr_instantiate_rev_with_depth(struct expr e, unsigned int depth, s
 
 // owned fn, borrowed vals, owned return
 // assumes forall i, i < count -> expr_get_bvar_range(vals[i]) == 0
-struct expr expr_instantiate_rev(struct expr fn, struct expr * vals, unsigned int count) {
+struct expr expr_instantiate_rev(struct expr_heap * heap, struct expr fn, struct expr * vals, unsigned int count) {
 	// TODO: cache
-	return expr_instantiate_rev_with_depth(fn, 0, vals, count);
+	return expr_instantiate_rev_with_depth(heap, fn, 0, vals, count);
 }
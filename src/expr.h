@@ -7,11 +7,13 @@ struct expr {
 	// bound variables are represented as `(struct expr_node *) ((x << 1) | 1)`
 	struct expr_node * node;
 	unsigned int lam_count; // amount of surrounding lambdas
+	unsigned int loc; // location of the outermost of those lambdas (see `struct expr_node`)
 };
 
 struct expr_node {
 	struct expr fn;
 	unsigned int rc;
+	unsigned int loc; // index into the `src_locs` of the program (0 if unknown), kept by copies
 	struct expr arg;
 	unsigned int bvar_range;
 };
@@ -47,37 +49,77 @@ static inline struct expr_node * mk_op_expr_node(unsigned int op_index) {
 }
 
 static inline struct expr mk_bvar_expr(unsigned int var_index) {
-	return (struct expr) { .node = mk_bvar_expr_node(var_index), .lam_count = 0 };
+	return (struct expr) { .node = mk_bvar_expr_node(var_index), .lam_count = 0, .loc = 0 };
 }
 
 static inline struct expr mk_op_expr(unsigned int op_index) {
-	return (struct expr) { .node = mk_op_expr_node(op_index), .lam_count = 0 };
+	return (struct expr) { .node = mk_op_expr_node(op_index), .lam_count = 0, .loc = 0 };
 }
 
-struct expr_node * mk_app_expr_node();
+// App nodes are allocated from slabs, freed nodes are kept in a free list for reuse.
+// Heaps are independent of each other, but nodes must only refer to nodes of the same heap
+// and a heap must only be used by one thread at a time.
+struct expr_slab {
+	struct expr_slab * next;
+	size_t count;
+	struct expr_node nodes[];
+};
+
+struct expr_heap {
+	struct expr_slab * slabs; // owned, newest first
+	struct expr_node * free_list; // linked through `fn.node`
+	size_t fresh; // nodes of the newest slab that haven't been handed out yet
+	size_t capacity; // total nodes in all slabs
+	size_t live;
+	size_t allocs; // total allocations, never reset
+	size_t allocs_at_compact;
+	size_t live_at_compact;
+
+	// during compaction
+	struct expr_slab * old_slabs; // owned
+	struct expr_node ** * compact_stack; // owned, references still to be moved, the top one is moved next
+	size_t compact_stack_size;
+	size_t compact_stack_capacity;
+};
+
+void expr_heap_init(struct expr_heap * heap);
+// releases all nodes of the heap at once, no matter their reference counts
+void expr_heap_free(struct expr_heap * heap);
+
+struct expr_node * mk_app_expr_node(struct expr_heap * heap);
+void free_expr_node(struct expr_heap * heap, struct expr_node * node);
+
+// Compaction copies the nodes reachable from all roots into a single new slab,
+// in depth-first order with the function first, and releases all the old slabs.
+// Any node that isn't reachable from one of the roots passed to `expr_heap_compact_root`
+// between `expr_heap_compact_begin` and `expr_heap_compact_end` is gone afterwards.
+int expr_heap_should_compact(struct expr_heap * heap);
+void expr_heap_compact_begin(struct expr_heap * heap);
+void expr_heap_compact_root(struct expr_heap * heap, struct expr * e);
+void expr_heap_compact_end(struct expr_heap * heap);
 
 // owned fn, owned arg, owned return
-struct expr mk_app_expr(struct expr fn, struct expr arg);
+struct expr mk_app_expr(struct expr_heap * heap, struct expr fn, struct expr arg);
 
 // owned body, owned return
 static inline struct expr mk_lam_expr(struct expr body) {
-	return (struct expr) { .node = body.node, .lam_count = body.lam_count + 1 };
+	return (struct expr) { .node = body.node, .lam_count = body.lam_count + 1, .loc = body.loc };
 }
 
 // owned body, owned return
 static inline struct expr mk_multi_lam_expr(struct expr body, unsigned int n) {
-	return (struct expr) { .node = body.node, .lam_count = body.lam_count + n };
+	return (struct expr) { .node = body.node, .lam_count = body.lam_count + n, .loc = body.loc };
 }
 
 void expr_inc_rc(struct expr e);
-void expr_dec_rc(struct expr e);
+void expr_dec_rc(struct expr_heap * heap, struct expr e);
 
 // owned e, owned return (with rc 1)
-struct expr_node * expr_node_dup_if_shared(struct expr_node * node);
+struct expr_node * expr_node_dup_if_shared(struct expr_heap * heap, struct expr_node * node);
 
 void update_expr_data(struct expr expr);
 
 // owned e, borrowed vals, owned return
-struct expr expr_instantiate_rev(struct expr e, struct expr * vals, unsigned int count);
+struct expr expr_instantiate_rev(struct expr_heap * heap, struct expr e, struct expr * vals, unsigned int count);
 
 #endif
@@ -0,0 +1,16 @@
+#include "parser.h"
+#include "iolambda.h"
+
+int iolambda_load(struct eval_state * state, char * fname, char * str, size_t len) {
+	struct expr_heap heap;
+	expr_heap_init(&heap);
+	struct parser parser;
+	parser_init(&parser, fname, str, len, &heap);
+	struct expr expr = parse_expr(&parser);
+	if (parser.error_count) {
+		expr_heap_free(&heap);
+		return parser.error_count;
+	}
+	eval_init(state, &heap, expr, 0);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef IOLAMBDA_H
+#define IOLAMBDA_H
+
+// Public header of the iolambda library (lib.c), for running programs in-process.
+// Operations are registered with `eval_set_op`, I/O goes through the `in` and `out` buffers
+// of the `eval_state` and `eval_step` runs the program.
+// Every state has its own node heap, so different states can run on different threads,
+// but a state must only be used by one thread at a time and terms can't be shared between states.
+// Handlers allocate the arguments they push from `state->heap` (`mk_app_expr(&state->heap, ...)`).
+// Heap compaction is off unless the state's `auto_compact` is set or `eval_compact` is called.
+// A state can be saved with `eval_snapshot_write` and restored with `eval_snapshot_read`.
+
+#include "expr.h"
+#include "expr_buf.h"
+#include "beta_eval.h"
+#include "snapshot.h"
+
+// Parses the program in `str` and prepares `state` for running it.
+// Returns the amount of errors (reported on stderr), `state` is only initialized if there were none.
+// `str` is not needed anymore afterwards.
+int iolambda_load(struct eval_state * state, char * fname, char * str, size_t len);
+
+#endif
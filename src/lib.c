@@ -0,0 +1,10 @@
+#include "expr.c"
+#include "parser.c"
+#include "print_expr.c"
+#include "beta_eval.c"
+#include "expr_buf.c"
+#include "iolambda.c"
+#include "profile.c"
+#include "src_locs.c"
+#include "emit_c.c"
+#include "snapshot.c"
@@ -1,15 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include "expr.h"
 #include "parser.h"
 #include "beta_eval.h"
+#include "profile.h"
+#include "emit_c.h"
+#include "snapshot.h"
 
 #define USAGE \
 	"Usage: %s [options] <file>\n" \
 	"\n" \
 	"Options:\n" \
 	"--trace: Show reduction trace\n" \
+	"--compact: Periodically compact the heap for locality on long runs\n" \
+	"--emit-c: Write the program compiled to C to stdout instead of running it\n" \
+	"--profile <out>: Write reduction counts per source location as folded stacks to <out>\n" \
+	"--snapshot-at-first-read <out>: Save the evaluator state to <out> when the program first reads input\n" \
+	"--restore <snapshot>: Continue from a snapshot, <file> is omitted (not with --profile or --emit-c)\n" \
 
 void show_usage(char **argv) {
 	fprintf(stderr, USAGE, argv[0]);
@@ -17,6 +26,11 @@ void show_usage(char **argv) {
 
 int main(int argc, char **argv) {
 	int enable_trace = 0;
+	int enable_compact = 0;
+	int enable_emit_c = 0;
+	char * profile_file = NULL;
+	char * snapshot_file = NULL;
+	char * restore_file = NULL;
 	int argi = 1;
 	while (argi < argc) {
 		char * arg = argv[argi];
@@ -27,6 +41,28 @@ int main(int argc, char **argv) {
 			}
 			if (strcmp(arg, "--trace") == 0) {
 				enable_trace = 1;
+			} else if (strcmp(arg, "--compact") == 0) {
+				enable_compact = 1;
+			} else if (strcmp(arg, "--emit-c") == 0) {
+				enable_emit_c = 1;
+			} else if (strcmp(arg, "--profile") == 0) {
+				if (argi >= argc) {
+					show_usage(argv);
+					return 1;
+				}
+				profile_file = argv[argi++];
+			} else if (strcmp(arg, "--snapshot-at-first-read") == 0) {
+				if (argi >= argc) {
+					show_usage(argv);
+					return 1;
+				}
+				snapshot_file = argv[argi++];
+			} else if (strcmp(arg, "--restore") == 0) {
+				if (argi >= argc) {
+					show_usage(argv);
+					return 1;
+				}
+				restore_file = argv[argi++];
 			} else {
 				fprintf(stderr, "Unknown option %s", arg);
 				show_usage(argv);
@@ -36,32 +72,99 @@ int main(int argc, char **argv) {
 			break;
 		}
 	}
-	if (argi >= argc) {
-		show_usage(argv);
+	// snapshots don't keep the source locations and a restored program has no source to compile
+	if (restore_file != NULL && (profile_file != NULL || enable_emit_c)) {
+		fprintf(stderr, "--restore can't be combined with %s\n", profile_file != NULL ? "--profile" : "--emit-c");
 		return 1;
 	}
-	FILE *f = fopen(argv[argi], "rb");
-	if (f == NULL) {
-		fprintf(stderr, "Failed to open file %s\n", argv[argi]);
-		return 1;
+	struct eval_state state;
+	struct src_locs locs;
+	struct profile profile;
+	// the snapshot being restored, the output replayed from it points into it
+	unsigned char *rdata = NULL;
+	const unsigned char *output = NULL;
+	size_t output_len = 0;
+	if (profile_file != NULL) {
+		src_locs_init(&locs, argv[argi]);
 	}
-	fseek(f, 0, SEEK_END);
-	size_t fsize = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	if (restore_file != NULL) {
+		FILE *rf = fopen(restore_file, "rb");
+		if (rf == NULL) {
+			fprintf(stderr, "Failed to open file %s\n", restore_file);
+			return 1;
+		}
+		fseek(rf, 0, SEEK_END);
+		size_t rsize = ftell(rf);
+		fseek(rf, 0, SEEK_SET);
 
-	char *data = malloc(fsize);
-	fread(data, fsize, 1, f);
-	fclose(f);
+		rdata = malloc(rsize);
+		size_t rread = rdata != NULL ? fread(rdata, 1, rsize, rf) : 0;
+		fclose(rf);
 
-	struct parser parser;
-	parser_init(&parser, argv[argi], data, fsize);
-	struct expr expr = parse_expr(&parser);
-	free(data);
-	if (parser.error_count) {
-		fprintf(stderr, "%d errors\n", parser.error_count);
-		expr_dec_rc(expr);
-		return 1;
+		int failed = eval_snapshot_read(&state, rdata, rread, &output, &output_len);
+		if (failed) {
+			free(rdata);
+			fprintf(stderr, "Invalid snapshot %s\n", restore_file);
+			return 1;
+		}
+		fwrite(output, 1, output_len, stdout);
+	} else {
+		if (argi >= argc) {
+			show_usage(argv);
+			return 1;
+		}
+		FILE *f = fopen(argv[argi], "rb");
+		if (f == NULL) {
+			fprintf(stderr, "Failed to open file %s\n", argv[argi]);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		size_t fsize = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		char *data = malloc(fsize);
+		fread(data, fsize, 1, f);
+		fclose(f);
+
+		struct expr_heap heap;
+		expr_heap_init(&heap);
+		struct parser parser;
+		parser_init(&parser, argv[argi], data, fsize, &heap);
+		if (profile_file != NULL) {
+			parser.locs = &locs;
+		}
+		struct expr expr = parse_expr(&parser);
+		free(data);
+		if (parser.error_count) {
+			fprintf(stderr, "%d errors\n", parser.error_count);
+			expr_heap_free(&heap);
+			return 1;
+		}
+
+		if (enable_emit_c) {
+			emit_c(expr, stdout);
+			expr_heap_free(&heap);
+			return 0;
+		}
+		eval_init(&state, &heap, expr, 0);
 	}
+	state.trace = enable_trace;
+	state.auto_compact = enable_compact;
 
-	eval_by_reduce(expr, enable_trace);
+	if (profile_file != NULL) {
+		profile_init(&profile, &locs, profile_file);
+		state.profile = &profile;
+#ifdef SIGPIPE
+		// let a closed stdout end the run normally so the profile gets saved
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	}
+	// a new snapshot has to replay the restored output as well
+	eval_run_stdio(&state, output, output_len, snapshot_file);
+	eval_free(&state);
+	free(rdata);
+	if (profile_file != NULL) {
+		profile_free(&profile);
+		src_locs_free(&locs);
+	}
 }
@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "parser.h"
 
@@ -5,84 +7,247 @@ int string_slice_eq(string_slice a, string_slice b) {
 	return a.len == b.len && memcmp(a.str, b.str, a.len) == 0;
 }
 
-void parser_init(struct parser * parser, char * fname, char * str, size_t len) {
+void parser_init(struct parser * parser, char * fname, char * str, size_t len, struct expr_heap * heap) {
 	parser->fname = fname;
 	parser->str = str;
 	parser->end = str + len;
 	parser->line_start = str;
 	parser->line_number = 1;
 	parser->error_count = 0;
+	parser->heap = heap;
+	parser->locs = NULL;
+	parser->token_pos = 0;
+	parser->token_count = 0;
 }
 
 #define parser_error(parser, fmt, ...) \
-	(void) (parser->error_count++ < 100 ? fprintf(stderr, "%s:%d:%d: error: " fmt "\n", (parser)->fname, (parser)->line_number, (int) ((parser)->str - (parser)->line_start), ##__VA_ARGS__) : (void) 0)
+	(void) (parser->error_count++ < 100 ? fprintf(stderr, "%s:%d:%d: error: " fmt "\n", (parser)->fname, (parser)->token.line, (int) ((parser)->token.value.str + (parser)->token.value.len - (parser)->token.line_start), ##__VA_ARGS__) : (void) 0)
 
 static int is_id_char(unsigned char ch) {
 	return ch >= 0x21 && ch != '\\' && ch != '(' && ch != ')' && ch != '.' && ch != ',';
 }
 
-static struct token parser_next_token(struct parser * parser) {
-	struct token token;
-	while (1) {
-		if (parser->str == parser->end) {
-			token.type = TOKEN_EOF;
-			return token;
+// Vectorized classification of LEX_WIDTH bytes at once into bitmasks (bit i for byte i)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LEX_WIDTH 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LEX_WIDTH 16
+#else
+#define LEX_WIDTH 0
+#endif
+
+#if LEX_WIDTH > 0
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+
+static inline unsigned int lex_ctz(uint32_t x) {
+	unsigned long i;
+	_BitScanForward(&i, x);
+	return (unsigned int) i;
+}
+
+static inline unsigned int lex_highest_bit(uint32_t x) {
+	unsigned long i;
+	_BitScanReverse(&i, x);
+	return (unsigned int) i;
+}
+
+static inline unsigned int lex_popcount(uint32_t x) {
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F;
+	return (x * 0x01010101) >> 24;
+}
+#else
+static inline unsigned int lex_ctz(uint32_t x) {
+	return (unsigned int) __builtin_ctz(x);
+}
+
+static inline unsigned int lex_highest_bit(uint32_t x) {
+	return 31 - (unsigned int) __builtin_clz(x);
+}
+
+static inline unsigned int lex_popcount(uint32_t x) {
+	return (unsigned int) __builtin_popcount(x);
+}
+#endif
+
+struct lex_masks {
+	uint32_t space; // ' ', '\t', '\r' and '\n'
+	uint32_t newline;
+	uint32_t id; // is_id_char
+};
+
+static inline struct lex_masks lex_classify(const char * p) {
+	struct lex_masks masks;
+#if LEX_WIDTH == 32
+	__m256i v = _mm256_loadu_si256((const __m256i *) p);
+	__m256i nl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+	__m256i space = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), nl));
+	// unsigned ch >= 0x21
+	__m256i printable = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x21)), v);
+	__m256i punct = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('('))),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')))));
+	masks.space = (uint32_t) _mm256_movemask_epi8(space);
+	masks.newline = (uint32_t) _mm256_movemask_epi8(nl);
+	masks.id = (uint32_t) _mm256_movemask_epi8(_mm256_andnot_si256(punct, printable));
+#else
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	__m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+	__m128i space = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), nl));
+	// unsigned ch >= 0x21
+	__m128i printable = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x21)), v);
+	__m128i punct = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')), _mm_cmpeq_epi8(v, _mm_set1_epi8('('))),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(')')),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')), _mm_cmpeq_epi8(v, _mm_set1_epi8(',')))));
+	masks.space = (uint32_t) _mm_movemask_epi8(space);
+	masks.newline = (uint32_t) _mm_movemask_epi8(nl);
+	masks.id = (uint32_t) _mm_movemask_epi8(_mm_andnot_si128(punct, printable));
+#endif
+	return masks;
+}
+
+#if LEX_WIDTH == 32
+#define LEX_ALL_BITS 0xFFFFFFFFu
+#else
+#define LEX_ALL_BITS 0xFFFFu
+#endif
+#endif
+
+static void parser_skip_space(struct parser * parser) {
+	char * p = parser->str;
+#if LEX_WIDTH > 0
+	while (parser->end - p >= LEX_WIDTH) {
+		struct lex_masks masks = lex_classify(p);
+		uint32_t other = ~masks.space & LEX_ALL_BITS;
+		unsigned int skip = other != 0 ? lex_ctz(other) : LEX_WIDTH;
+		uint32_t newlines = skip < 32 ? masks.newline & ((1u << skip) - 1) : masks.newline;
+		if (newlines != 0) {
+			parser->line_number += lex_popcount(newlines);
+			parser->line_start = p + lex_highest_bit(newlines) + 1;
 		}
-		char c = *parser->str;
-		if (c == ' ' || c == '\t' || c == '\r') {
-			parser->str++;
-			continue;
+		p += skip;
+		if (skip < LEX_WIDTH) {
+			parser->str = p;
+			return;
 		}
+	}
+#endif
+	while (p != parser->end) {
+		char c = *p;
 		if (c == '\n') {
-			parser->str++;
+			p++;
 			parser->line_number++;
-			parser->line_start = parser->str;
+			parser->line_start = p;
 			continue;
 		}
-		break;
+		if (c != ' ' && c != '\t' && c != '\r') {
+			break;
+		}
+		p++;
+	}
+	parser->str = p;
+}
+
+static void parser_skip_id(struct parser * parser) {
+	char * p = parser->str;
+#if LEX_WIDTH > 0
+	while (parser->end - p >= LEX_WIDTH) {
+		uint32_t other = ~lex_classify(p).id & LEX_ALL_BITS;
+		if (other != 0) {
+			parser->str = p + lex_ctz(other);
+			return;
+		}
+		p += LEX_WIDTH;
+	}
+#endif
+	while (p != parser->end && is_id_char(*p)) {
+		p++;
 	}
+	parser->str = p;
+}
+
+static struct token parser_lex_token(struct parser * parser) {
+	struct token token;
+	parser_skip_space(parser);
 	token.value.str = parser->str;
+	token.line = parser->line_number;
+	token.line_start = parser->line_start;
+	if (parser->str == parser->end) {
+		token.type = TOKEN_EOF;
+		token.value.len = 0;
+		return token;
+	}
 	char c = *parser->str++;
+	token.value.len = 1;
 	if (c == '\\') {
 		token.type = TOKEN_LAMBDA;
-		token.value.len = 1;
 		return token;
 	} else if (c == '(') {
 		token.type = TOKEN_LPAREN;
-		token.value.len = 1;
 		return token;
 	} else if (c == ')') {
 		token.type = TOKEN_RPAREN;
-		token.value.len = 1;
 		return token;
 	} else if (c == '.' || c == ',') {
 		token.type = TOKEN_SEP;
-		token.value.len = 1;
 		return token;
 	}
 	if (!is_id_char(c)) {
-		parser_error(parser, "Invalid character");
+		// reported once parse_expr gets to it
 		token.type = TOKEN_ERROR;
 		return token;
 	}
 	token.type = TOKEN_IDENT;
-	while (parser->str != parser->end && is_id_char(*parser->str)) {
-		parser->str++;
-	}
+	parser_skip_id(parser);
 	token.value.len = parser->str - token.value.str;
 	return token;
 }
 
+static struct token parser_next_token(struct parser * parser) {
+	if (parser->token_pos == parser->token_count) {
+		unsigned int count = 0;
+		do {
+			parser->tokens[count] = parser_lex_token(parser);
+		} while (parser->tokens[count++].type != TOKEN_EOF && count < PARSER_TOKEN_BATCH);
+		parser->token_pos = 0;
+		parser->token_count = count;
+	}
+	parser->token = parser->tokens[parser->token_pos++];
+	if (parser->token.type == TOKEN_ERROR) {
+		parser_error(parser, "Invalid character");
+	}
+	return parser->token;
+}
+
 struct lambda_parse_scope {
 	struct expr * hole;
 	unsigned int lam_depth;
 	int var_index;
+	// start of the expression in the hole
+	int start_line;
+	int start_column;
 };
 
 struct expr parse_expr(struct parser * parser) {
-	struct expr result = { .node = NULL, .lam_count = 0 };
+	struct expr result = { .node = NULL, .lam_count = 0, .loc = 0 };
 	struct lambda_parse_scope * scopes = malloc(sizeof(struct lambda_parse_scope) * 64);
 	string_slice * vars = malloc(sizeof(string_slice) * 64);
+	// location of the lambda group binding each variable;
+	// the lambdas of a hole bind the last `hole_depth` variables,
+	// and right after a ')' the lambdas closed by it are still right above `var_count`
+	unsigned int * var_locs = malloc(sizeof(unsigned int) * 64);
 	int scope_count = 1;
 	int scope_capacity = 64;
 	int var_count = 0;
@@ -90,6 +255,8 @@ struct expr parse_expr(struct parser * parser) {
 	scopes[0].hole = &result;
 	scopes[0].lam_depth = 0;
 	scopes[0].var_index = 0;
+	scopes[0].start_line = 0;
+	scopes[0].start_column = 0;
 	while (1) {
 		struct token token = parser_next_token(parser);
 		if (token.type == TOKEN_EOF) {
@@ -122,19 +289,30 @@ struct expr parse_expr(struct parser * parser) {
 		struct expr * hole = scopes[scope_count - 1].hole;
 		unsigned int hole_depth = scopes[scope_count - 1].lam_depth;
 		if (hole->node != NULL) {
-			struct expr_node * node = mk_app_expr_node();
-			node->fn = (struct expr) { .node = hole->node, .lam_count = hole->lam_count - hole_depth };
+			struct expr_node * node = mk_app_expr_node(parser->heap);
+			unsigned int fn_lam_count = hole->lam_count - hole_depth;
+			node->fn = (struct expr) { .node = hole->node, .lam_count = fn_lam_count, .loc = fn_lam_count > 0 ? var_locs[var_count] : 0 };
 			node->arg.node = NULL;
-			*hole = (struct expr) { .node = node, .lam_count = hole_depth };
+			if (parser->locs != NULL) {
+				node->loc = src_locs_add(parser->locs, scopes[scope_count - 1].start_line, scopes[scope_count - 1].start_column);
+			}
+			*hole = (struct expr) { .node = node, .lam_count = hole_depth, .loc = hole_depth > 0 ? var_locs[var_count - hole_depth] : 0 };
 			hole = &node->arg;
 			hole_depth = 0;
+		} else {
+			scopes[scope_count - 1].start_line = token.line;
+			scopes[scope_count - 1].start_column = (int) (token.value.str - token.line_start) + 1;
 		}
 		if (token.type == TOKEN_IDENT) {
 			int i = var_count;
 			while (i != 0) {
 				i--;
 				if (string_slice_eq(token.value, vars[i])) {
-					*hole = (struct expr) { .node = mk_bvar_expr_node(var_count - i - 1), .lam_count = hole_depth };
+					*hole = (struct expr) {
+						.node = mk_bvar_expr_node(var_count - i - 1),
+						.lam_count = hole_depth,
+						.loc = hole_depth > 0 ? var_locs[var_count - hole_depth] : 0
+					};
 					goto ident_end;
 				}
 			}
@@ -154,18 +332,26 @@ ident_end:
 			scopes[scope_count++] = (struct lambda_parse_scope) {
 				.hole = hole,
 				.lam_depth = hole_depth,
-				.var_index = var_count
+				.var_index = var_count,
+				.start_line = 0,
+				.start_column = 0
 			};
 			continue;
 		}
 		if (token.type == TOKEN_LAMBDA) {
+			unsigned int lam_loc = 0;
+			if (parser->locs != NULL) {
+				lam_loc = src_locs_add(parser->locs, token.line, (int) (token.value.str - token.line_start) + 1);
+			}
 			while (1) {
 				token = parser_next_token(parser);
 				if (token.type == TOKEN_IDENT) {
 					if (var_count >= var_capacity) {
 						vars = realloc(vars, sizeof(string_slice) * var_capacity * 2);
+						var_locs = realloc(var_locs, sizeof(unsigned int) * var_capacity * 2);
 						var_capacity *= 2;
 					}
+					var_locs[var_count] = lam_loc;
 					vars[var_count++] = token.value;
 					hole_depth++;
 					continue;
@@ -192,5 +378,6 @@ ident_end:
 	update_expr_data(result);
 	free(scopes);
 	free(vars);
+	free(var_locs);
 	return result;
 }
@@ -2,6 +2,7 @@
 #define PARSER_H
 
 #include "expr.h"
+#include "src_locs.h"
 
 typedef struct {
 	char *str;
@@ -10,15 +11,6 @@ typedef struct {
 
 int string_slice_eq(string_slice a, string_slice b);
 
-struct parser {
-	char * fname;
-	char * str;
-	char * end;
-	char * line_start;
-	int line_number;
-	int error_count;
-};
-
 enum token_type {
 	TOKEN_ERROR,
 	TOKEN_EOF,
@@ -32,9 +24,29 @@ enum token_type {
 struct token {
 	enum token_type type;
 	string_slice value;
+	int line;
+	char * line_start;
+};
+
+// tokens are lexed ahead in batches of this size
+#define PARSER_TOKEN_BATCH 256
+
+struct parser {
+	char * fname;
+	char * str;
+	char * end;
+	char * line_start;
+	int line_number;
+	int error_count;
+	struct expr_heap * heap; // borrowed, the nodes are allocated from it
+	struct src_locs * locs; // borrowed, if not NULL the locations of app nodes are recorded
+	struct token token; // last token handed out, errors are reported at its end
+	struct token tokens[PARSER_TOKEN_BATCH];
+	unsigned int token_pos;
+	unsigned int token_count;
 };
 
-void parser_init(struct parser * parser, char * fname, char * str, size_t len);
+void parser_init(struct parser * parser, char * fname, char * str, size_t len, struct expr_heap * heap);
 struct expr parse_expr(struct parser * parser);
 
 #endif
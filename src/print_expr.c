@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include "print_expr.h"
 
 static unsigned int num_length(unsigned int val) {
@@ -62,7 +63,7 @@ void dbg_print_expr(struct expr expr, char ** out, int parens) {
 			*(*out)++ = ']';
 		}
 		*(*out)++ = ' ';
-		dbg_print_expr((struct expr) { .node = expr.node, .lam_count = 0 }, out, 0);
+		dbg_print_expr((struct expr) { .node = expr.node, .lam_count = 0, .loc = 0 }, out, 0);
 		if (parens & 1) {
 			*(*out)++ = ')';
 		}
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include "profile.h"
+
+void profile_init(struct profile * profile, struct src_locs * locs, char * out_file) {
+	profile->locs = locs;
+	profile->out_file = out_file;
+	profile->capacity = 256;
+	profile->size = 0;
+	profile->entries = calloc(profile->capacity, sizeof(struct profile_entry));
+}
+
+void profile_free(struct profile * profile) {
+	free(profile->entries);
+	profile->entries = NULL;
+	profile->capacity = 0;
+	profile->size = 0;
+}
+
+static size_t profile_hash(enum profile_event event, unsigned int site, unsigned int target) {
+	size_t h = (size_t) event * 0x9E3779B9u;
+	h = (h ^ site) * 0x85EBCA6Bu;
+	h = (h ^ target) * 0xC2B2AE35u;
+	return h ^ (h >> 15);
+}
+
+static struct profile_entry * profile_find(struct profile_entry * entries, size_t capacity, enum profile_event event, unsigned int site, unsigned int target) {
+	size_t i = profile_hash(event, site, target) & (capacity - 1);
+	while (1) {
+		struct profile_entry * entry = &entries[i];
+		if (entry->count == 0 || (entry->event == event && entry->site == site && entry->target == target)) {
+			return entry;
+		}
+		i = (i + 1) & (capacity - 1);
+	}
+}
+
+void profile_count(struct profile * profile, enum profile_event event, unsigned int site, unsigned int target, size_t count) {
+	if (count == 0) {
+		return;
+	}
+	struct profile_entry * entry = profile_find(profile->entries, profile->capacity, event, site, target);
+	if (entry->count != 0) {
+		entry->count += count;
+		return;
+	}
+	if ((profile->size + 1) * 2 > profile->capacity) {
+		size_t new_capacity = profile->capacity * 2;
+		struct profile_entry * new_entries = calloc(new_capacity, sizeof(struct profile_entry));
+		for (size_t i = 0; i < profile->capacity; i++) {
+			if (profile->entries[i].count != 0) {
+				struct profile_entry * e = &profile->entries[i];
+				*profile_find(new_entries, new_capacity, e->event, e->site, e->target) = *e;
+			}
+		}
+		free(profile->entries);
+		profile->entries = new_entries;
+		profile->capacity = new_capacity;
+		entry = profile_find(profile->entries, profile->capacity, event, site, target);
+	}
+	*entry = (struct profile_entry) { .event = event, .site = site, .target = target, .count = count };
+	profile->size++;
+}
+
+static void profile_write_loc(struct profile * profile, unsigned int loc, FILE * f) {
+	if (loc == 0 || profile->locs == NULL || loc >= profile->locs->size) {
+		fputs("?", f);
+		return;
+	}
+	struct src_loc l = profile->locs->data[loc];
+	fprintf(f, "%s:%d:%d", profile->locs->fname, l.line, l.column);
+}
+
+void profile_write_folded(struct profile * profile, FILE * f) {
+	static const char * event_names[] = { "beta", "alloc", "op" };
+	for (size_t i = 0; i < profile->capacity; i++) {
+		struct profile_entry * entry = &profile->entries[i];
+		if (entry->count == 0) {
+			continue;
+		}
+		fprintf(f, "%s;", event_names[entry->event]);
+		profile_write_loc(profile, entry->site, f);
+		if (entry->event == PROFILE_OP) {
+			fprintf(f, ";!%u", entry->target);
+		} else {
+			fputc(';', f);
+			profile_write_loc(profile, entry->target, f);
+		}
+		fprintf(f, " %zu\n", entry->count);
+	}
+}
+
+int profile_save(struct profile * profile) {
+	if (profile->out_file == NULL) {
+		return 1;
+	}
+	FILE * f = fopen(profile->out_file, "w");
+	if (f == NULL) {
+		return 1;
+	}
+	profile_write_folded(profile, f);
+	return fclose(f) != 0;
+}
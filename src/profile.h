@@ -0,0 +1,38 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "src_locs.h"
+
+enum profile_event {
+	PROFILE_BETA, // target is the location of the lambda group
+	PROFILE_ALLOC, // target is the location of the lambda group
+	PROFILE_OP, // target is the operation number
+};
+
+struct profile_entry {
+	enum profile_event event;
+	unsigned int site; // location of the last application that was unwound
+	unsigned int target;
+	size_t count; // 0 for unused entries
+};
+
+struct profile {
+	struct src_locs * locs; // borrowed
+	char * out_file; // borrowed, can be NULL, where `profile_save` writes to
+	struct profile_entry * entries; // owned, open addressing
+	size_t capacity;
+	size_t size;
+};
+
+void profile_init(struct profile * profile, struct src_locs * locs, char * out_file);
+void profile_free(struct profile * profile);
+void profile_count(struct profile * profile, enum profile_event event, unsigned int site, unsigned int target, size_t count);
+
+// Writes one line per entry in the folded stack format of flame graph tools
+void profile_write_folded(struct profile * profile, FILE * f);
+
+// Replaces `out_file` with the current counts, returns 0 on success
+int profile_save(struct profile * profile);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "IOLSNAP1"
+
+struct snapshot_header {
+	char magic[8];
+	uint64_t node_count;
+	uint64_t arg_count;
+	uint64_t output_len;
+	int32_t op_stream;
+	uint8_t byte_read;
+	uint8_t byte_read_mask;
+	uint8_t byte_write;
+	uint8_t byte_write_mask;
+};
+
+// app nodes are stored as `index << 2`, bound variables and operations as their tagged value
+struct snapshot_expr {
+	uint64_t node;
+	uint32_t lam_count;
+	uint32_t loc;
+};
+
+// nodes are stored children first, so every node only refers to earlier ones
+struct snapshot_node {
+	struct snapshot_expr fn;
+	struct snapshot_expr arg;
+	uint32_t rc;
+	uint32_t bvar_range;
+	uint32_t loc;
+	uint32_t reserved;
+};
+
+// maps nodes to their index, open addressing
+struct snapshot_writer {
+	struct expr_node ** keys; // owned
+	uint64_t * indices; // owned
+	size_t capacity;
+	size_t size;
+	struct expr_node ** nodes; // owned, in storage order
+	size_t node_count;
+	size_t node_capacity;
+	struct expr_node ** stack; // owned, nodes whose children are being visited
+	size_t stack_size;
+	size_t stack_capacity;
+};
+
+static size_t snapshot_hash(struct expr_node * node) {
+	size_t h = (size_t) node >> 4;
+	h *= 0x9E3779B97F4A7C15ull;
+	return h ^ (h >> 29);
+}
+
+static uint64_t * snapshot_find(struct snapshot_writer * w, struct expr_node * node, int * found) {
+	size_t i = snapshot_hash(node) & (w->capacity - 1);
+	while (w->keys[i] != NULL && w->keys[i] != node) {
+		i = (i + 1) & (w->capacity - 1);
+	}
+	*found = w->keys[i] != NULL;
+	if (!*found) {
+		w->keys[i] = node;
+		w->indices[i] = 0;
+		w->size++;
+	}
+	return &w->indices[i];
+}
+
+static void snapshot_grow(struct snapshot_writer * w) {
+	struct expr_node ** old_keys = w->keys;
+	uint64_t * old_indices = w->indices;
+	size_t old_capacity = w->capacity;
+	w->capacity = old_capacity < 64 ? 64 : old_capacity * 2;
+	w->size = 0;
+	w->keys = calloc(w->capacity, sizeof(struct expr_node *));
+	w->indices = malloc(sizeof(uint64_t) * w->capacity);
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (old_keys[i] != NULL) {
+			int found;
+			*snapshot_find(w, old_keys[i], &found) = old_indices[i];
+		}
+	}
+	free(old_keys);
+	free(old_indices);
+}
+
+// adds node to the table if it isn't there yet, returns whether it was
+static int snapshot_add(struct snapshot_writer * w, struct expr_node * node) {
+	if ((w->size + 1) * 2 > w->capacity) {
+		snapshot_grow(w);
+	}
+	int found;
+	snapshot_find(w, node, &found);
+	return found;
+}
+
+// Assigns indices to the nodes of e that don't have one yet, children first.
+// Iterative with the path from e on `w->stack`, the graph can be far deeper than the C stack.
+static void snapshot_visit(struct snapshot_writer * w, struct expr e) {
+	if (!expr_node_is_app(e.node) || snapshot_add(w, e.node)) {
+		return;
+	}
+	w->stack_size = 0;
+	w->stack[w->stack_size++] = e.node;
+	while (w->stack_size > 0) {
+		struct expr_node * node = w->stack[w->stack_size - 1];
+		struct expr_node * child = NULL;
+		if (expr_node_is_app(node->fn.node) && !snapshot_add(w, node->fn.node)) {
+			child = node->fn.node;
+		} else if (expr_node_is_app(node->arg.node) && !snapshot_add(w, node->arg.node)) {
+			child = node->arg.node;
+		}
+		if (child != NULL) {
+			if (w->stack_size >= w->stack_capacity) {
+				w->stack_capacity *= 2;
+				w->stack = realloc(w->stack, sizeof(struct expr_node *) * w->stack_capacity);
+			}
+			w->stack[w->stack_size++] = child;
+			continue;
+		}
+		w->stack_size--;
+		int found;
+		*snapshot_find(w, node, &found) = w->node_count;
+		if (w->node_count >= w->node_capacity) {
+			w->node_capacity = w->node_capacity < 64 ? 64 : w->node_capacity * 2;
+			w->nodes = realloc(w->nodes, sizeof(struct expr_node *) * w->node_capacity);
+		}
+		w->nodes[w->node_count++] = node;
+	}
+}
+
+static struct snapshot_expr snapshot_encode(struct snapshot_writer * w, struct expr e) {
+	struct snapshot_expr out = { .node = (uint64_t) (size_t) e.node, .lam_count = e.lam_count, .loc = e.loc };
+	if (expr_node_is_app(e.node)) {
+		int found;
+		out.node = *snapshot_find(w, e.node, &found) << 2;
+	}
+	return out;
+}
+
+int eval_snapshot_write(struct eval_state * state, const unsigned char * output, size_t output_len, eval_snapshot_writer write, void * user) {
+	struct snapshot_writer w = {
+		.keys = NULL, .indices = NULL, .capacity = 0, .size = 0,
+		.nodes = NULL, .node_count = 0, .node_capacity = 0,
+		.stack = malloc(sizeof(struct expr_node *) * 64), .stack_size = 0, .stack_capacity = 64
+	};
+	snapshot_grow(&w);
+	snapshot_visit(&w, state->e);
+	for (size_t i = state->args.off; i < state->args.size; i++) {
+		snapshot_visit(&w, state->args.data[i]);
+	}
+
+	struct snapshot_header header;
+	memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+	header.node_count = w.node_count;
+	header.arg_count = state->args.size - state->args.off;
+	header.output_len = output_len;
+	header.op_stream = state->op_stream;
+	header.byte_read = state->byte_read;
+	header.byte_read_mask = state->byte_read_mask;
+	header.byte_write = state->byte_write;
+	header.byte_write_mask = state->byte_write_mask;
+	int ok = write(user, &header, sizeof(header)) == 0;
+	for (size_t i = 0; ok && i < w.node_count; i++) {
+		struct expr_node * node = w.nodes[i];
+		struct snapshot_node out = {
+			.fn = snapshot_encode(&w, node->fn),
+			.arg = snapshot_encode(&w, node->arg),
+			.rc = node->rc,
+			.bvar_range = node->bvar_range,
+			.loc = node->loc,
+			.reserved = 0
+		};
+		ok = write(user, &out, sizeof(out)) == 0;
+	}
+	struct snapshot_expr root = snapshot_encode(&w, state->e);
+	ok = ok && write(user, &root, sizeof(root)) == 0;
+	for (size_t i = state->args.off; ok && i < state->args.size; i++) {
+		struct snapshot_expr arg = snapshot_encode(&w, state->args.data[i]);
+		ok = write(user, &arg, sizeof(arg)) == 0;
+	}
+	ok = ok && (output_len == 0 || write(user, output, output_len) == 0);
+	free(w.keys);
+	free(w.indices);
+	free(w.nodes);
+	free(w.stack);
+	return ok ? 0 : 1;
+}
+
+// copies the next `len` bytes of the snapshot to out, returns 0 if there aren't enough left
+static int snapshot_take(const unsigned char ** data, const unsigned char * end, void * out, size_t len) {
+	if ((size_t) (end - *data) < len) {
+		return 0;
+	}
+	memcpy(out, *data, len);
+	*data += len;
+	return 1;
+}
+
+// returns 0 if the expression refers to a node that doesn't exist (yet)
+static int snapshot_decode(struct snapshot_expr in, struct expr_node ** nodes, uint64_t node_count, struct expr * out) {
+	out->lam_count = in.lam_count;
+	out->loc = in.loc;
+	if ((in.node & 1) == 0) {
+		if ((in.node >> 2) >= node_count) {
+			return 0;
+		}
+		out->node = nodes[in.node >> 2];
+	} else {
+		out->node = (struct expr_node *) (size_t) in.node;
+	}
+	return 1;
+}
+
+int eval_snapshot_read(struct eval_state * state, const unsigned char * data, size_t len, const unsigned char ** output, size_t * output_len) {
+	const unsigned char * end = data + len;
+	struct snapshot_header header;
+	if (!snapshot_take(&data, end, &header, sizeof(header)) || memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0) {
+		return 1;
+	}
+	// the counts come from the file, so check them against its size before allocating anything
+	size_t rest = (size_t) (end - data);
+	if (header.node_count > rest / sizeof(struct snapshot_node)) {
+		return 1;
+	}
+	rest -= (size_t) header.node_count * sizeof(struct snapshot_node);
+	// the root and the arguments
+	if (header.arg_count >= rest / sizeof(struct snapshot_expr)) {
+		return 1;
+	}
+	rest -= (size_t) (header.arg_count + 1) * sizeof(struct snapshot_expr);
+	if (header.output_len > rest) {
+		return 1;
+	}
+	struct expr_node ** nodes = malloc(sizeof(struct expr_node *) * ((size_t) header.node_count + 1));
+	if (nodes == NULL) {
+		return 1;
+	}
+	struct expr_heap heap;
+	expr_heap_init(&heap);
+	uint64_t node_count = 0;
+	int ok = 1;
+	while (ok && node_count < header.node_count) {
+		struct snapshot_node in;
+		if (!snapshot_take(&data, end, &in, sizeof(in))) {
+			ok = 0;
+			break;
+		}
+		struct expr_node * node = mk_app_expr_node(&heap);
+		if (!snapshot_decode(in.fn, nodes, node_count, &node->fn) || !snapshot_decode(in.arg, nodes, node_count, &node->arg)) {
+			ok = 0;
+			break;
+		}
+		node->rc = in.rc;
+		node->bvar_range = in.bvar_range;
+		node->loc = in.loc;
+		nodes[node_count++] = node;
+	}
+	struct snapshot_expr in;
+	struct expr e;
+	ok = ok && snapshot_take(&data, end, &in, sizeof(in)) && snapshot_decode(in, nodes, node_count, &e);
+	if (ok) {
+		eval_init(state, &heap, e, 0);
+		for (uint64_t i = 0; ok && i < header.arg_count; i++) {
+			struct expr arg;
+			ok = snapshot_take(&data, end, &in, sizeof(in)) && snapshot_decode(in, nodes, node_count, &arg);
+			if (ok) {
+				expr_buf_push(&state->args, arg);
+			}
+		}
+		state->op_stream = header.op_stream;
+		state->byte_read = header.byte_read;
+		state->byte_read_mask = header.byte_read_mask;
+		state->byte_write = header.byte_write;
+		state->byte_write_mask = header.byte_write_mask;
+		ok = ok && header.output_len <= (uint64_t) (end - data);
+		if (ok) {
+			*output = data;
+			*output_len = (size_t) header.output_len;
+		} else {
+			eval_free(state);
+		}
+	}
+	// the nodes are released all at once, the reference counts only add up once everything is there
+	expr_heap_free(&heap);
+	free(nodes);
+	return ok ? 0 : 1;
+}
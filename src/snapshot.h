@@ -0,0 +1,25 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include "beta_eval.h"
+
+// A snapshot holds the term graph (with reference counts and sharing), the arguments,
+// the operation stream and the partial input and output bytes of an eval_state,
+// plus the output the program produced before it was taken.
+// The operation table, the I/O buffers and the profile aren't saved.
+// Snapshots use the native byte order and are meant to be restored by the same build.
+
+// Called with consecutive pieces of the snapshot, returns 0 on success.
+// Snapshots are handed out through a callback instead of a FILE * so the library and its user
+// don't need to share a C runtime.
+typedef int (*eval_snapshot_writer)(void * user, const void * data, size_t len);
+
+// borrowed state, returns 0 on success
+int eval_snapshot_write(struct eval_state * state, const unsigned char * output, size_t output_len, eval_snapshot_writer write, void * user);
+
+// Initializes state (like eval_init) from the snapshot in `data`, `output` then points into `data`.
+// Returns 0 on success, state is left uninitialized otherwise.
+int eval_snapshot_read(struct eval_state * state, const unsigned char * data, size_t len, const unsigned char ** output, size_t * output_len);
+
+#endif
@@ -0,0 +1,30 @@
+#include <stdlib.h>
+#include "src_locs.h"
+
+void src_locs_init(struct src_locs * locs, char * fname) {
+	locs->fname = fname;
+	locs->data = malloc(sizeof(struct src_loc) * 64);
+	locs->data[0] = (struct src_loc) { .line = 0, .column = 0 };
+	locs->size = 1;
+	locs->capacity = 64;
+}
+
+void src_locs_free(struct src_locs * locs) {
+	free(locs->data);
+	locs->data = NULL;
+	locs->size = 0;
+	locs->capacity = 0;
+}
+
+unsigned int src_locs_add(struct src_locs * locs, int line, int column) {
+	struct src_loc * last = &locs->data[locs->size - 1];
+	if (locs->size > 1 && last->line == line && last->column == column) {
+		return locs->size - 1;
+	}
+	if (locs->size >= locs->capacity) {
+		locs->capacity *= 2;
+		locs->data = realloc(locs->data, sizeof(struct src_loc) * locs->capacity);
+	}
+	locs->data[locs->size] = (struct src_loc) { .line = line, .column = column };
+	return locs->size++;
+}
@@ -0,0 +1,22 @@
+#ifndef SRC_LOCS_H
+#define SRC_LOCS_H
+
+struct src_loc {
+	int line;
+	int column;
+};
+
+// Source locations of applications and lambda groups, app nodes and expressions refer to them
+// by their index in `loc` (0 is unknown)
+struct src_locs {
+	char * fname;
+	struct src_loc * data; // owned
+	unsigned int size;
+	unsigned int capacity;
+};
+
+void src_locs_init(struct src_locs * locs, char * fname);
+void src_locs_free(struct src_locs * locs);
+unsigned int src_locs_add(struct src_locs * locs, int line, int column);
+
+#endif